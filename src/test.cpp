@@ -10,6 +10,20 @@
 #include <condition_variable>
 #include <atomic>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+
+#include <elf.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "split.h"
 
@@ -64,6 +78,27 @@ public:
 
 const std::string DefaultCompilerPath = "/usr/bin/g++";
 const int DefaultThreads = 4;
+const std::string DefaultHistoryFile = "test-history.txt";
+const std::string DefaultBudgetFile = "test-budgets.txt";
+
+// Headroom added on rebaseline, relative to the measured value, with an
+// absolute minimum for the warning limit (twice that for the error limit).
+// Compile times vary by more than 50% between runs on a busy machine and
+// -ftime-report counts in 10 ms ticks, so time metrics get a lot of slack.
+struct BudgetMetric {
+    const char* name;
+    double warning_headroom;
+    double error_headroom;
+    double min_headroom;
+    bool integral;          // limits are saved as whole numbers
+};
+
+const BudgetMetric BudgetMetrics[] = {
+    {"compile_time", 1.0, 3.0, 0.5, false},
+    {"peak_rss", 0.25, 1.0, 2048, true},
+    {"text_size", 0.25, 1.0, 64, true},
+    {"instantiation_time", 1.0, 3.0, 0.2, false},
+};
 
 std::string two_digits(int x) {
     std::string a(2, 0);
@@ -77,8 +112,13 @@ std::string exe_name(const std::string& source_path, int cpp_version) {
     return "tmp/" + std::to_string(hasher(source_path + "@" + std::to_string(cpp_version))) + ".exe";
 }
 
+std::string report_name(const std::string& source_path, int cpp_version) {
+    return exe_name(source_path, cpp_version) + ".report";
+}
+
 std::string make_cmd(const std::string& compiler_path,
-    int cpp_version, const std::string& source_path, bool allow_warnings)
+    int cpp_version, const std::string& source_path, bool allow_warnings,
+    bool time_report = false)
 {
     std::string cmd = compiler_path;
     cmd += " -pedantic-errors";
@@ -91,21 +131,381 @@ std::string make_cmd(const std::string& compiler_path,
     cmd += two_digits(cpp_version);
     cmd += ' ';
     cmd += source_path;
-    cmd += " 2>/dev/null";
+    if (time_report) {
+        cmd += " -ftime-report 2>";
+        cmd += report_name(source_path, cpp_version);
+    } else {
+        cmd += " 2>/dev/null";
+    }
     return cmd;
 }
 
 std::mutex cout_mutex;
 
+// Durations (in seconds) of past compile and run steps, keyed by
+// compiler, snippet path relative to the sources folder, language version
+// and step kind. Entries of the current compiler that the current run did
+// not use are stale and are not saved; entries of other compilers are kept.
+class History {
+    std::map<std::string, double> m_durations;
+    std::set<std::string> m_used;
+    std::mutex m_mutex;
+
+public:
+    static std::string key(const std::string& compiler_path,
+        const std::string& snippet, int cpp_version, const std::string& kind)
+    {
+        return compiler_path + '\t' + snippet + '\t' + two_digits(cpp_version) + '\t' + kind;
+    }
+
+    static bool has_compiler(const std::string& key, const std::string& compiler_path) {
+        return key.compare(0, compiler_path.size() + 1, compiler_path + '\t') == 0;
+    }
+
+    void load(const std::string& path) {
+        std::ifstream stream(path);
+        std::string line;
+        while (std::getline(stream, line)) {
+            auto fields = split(line, '\t');
+            if (fields.size() != 5) {
+                continue;
+            }
+            double seconds = strtod(fields[4].c_str(), nullptr);
+            if (seconds > 0) {
+                m_durations[fields[0] + '\t' + fields[1] + '\t' + fields[2] + '\t' + fields[3]] = seconds;
+            }
+        }
+    }
+
+    void save(const std::string& path, const std::string& compiler_path) {
+        std::ofstream stream(path);
+        if (!stream.is_open()) {
+            std::cout << "Couldn't write history file: " << path << '\n';
+            return;
+        }
+        for (auto& [key, seconds] : m_durations) {
+            if (m_used.count(key) || !has_compiler(key, compiler_path)) {
+                stream << key << '\t' << seconds << '\n';
+            }
+        }
+    }
+
+    // Returns a negative value if there is no record.
+    double get(const std::string& key) {
+        std::unique_lock lock(m_mutex);
+        m_used.insert(key);
+        auto it = m_durations.find(key);
+        return it == m_durations.end() ? -1 : it->second;
+    }
+
+    void set(const std::string& key, double seconds) {
+        std::unique_lock lock(m_mutex);
+        m_used.insert(key);
+        m_durations[key] = seconds;
+    }
+
+    // Returns the longest recorded step with the given compiler.
+    double max(const std::string& compiler_path) {
+        std::unique_lock lock(m_mutex);
+        double result = 0;
+        for (auto& [key, seconds] : m_durations) {
+            if (has_compiler(key, compiler_path)) {
+                result = std::max(result, seconds);
+            }
+        }
+        return result;
+    }
+};
+
+// Runs a shell command and stores its wall-clock duration in seconds. Also
+// stores the CPU time in seconds and the peak resident set size in kilobytes
+// of the processes it spawned, which unlike wall-clock time do not depend on
+// how busy the machine is. Returns the wait status, like system().
+int timed_system(const std::string& cmd, double& seconds,
+    double* cpu_seconds = nullptr, long* peak_rss_kb = nullptr)
+{
+    auto start = std::chrono::steady_clock::now();
+    int status = -1;
+    rusage usage{};
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)nullptr);
+        _exit(127);
+    } else if (pid > 0) {
+        wait4(pid, &status, 0, &usage);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (cpu_seconds) {
+        *cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+    if (peak_rss_kb) {
+        *peak_rss_kb = usage.ru_maxrss;
+    }
+    return status;
+}
+
+// Returns the size of the .text section of an ELF64 file, or -1 on failure.
+long text_size(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    Elf64_Ehdr header;
+    if (!stream.read((char*)&header, sizeof(header))
+        || memcmp(header.e_ident, ELFMAG, SELFMAG) != 0
+        || header.e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        return -1;
+    }
+
+    std::vector<Elf64_Shdr> sections(header.e_shnum);
+    stream.seekg(header.e_shoff);
+    if (sections.empty() || header.e_shstrndx >= sections.size()
+        || !stream.read((char*)sections.data(), sections.size() * sizeof(Elf64_Shdr)))
+    {
+        return -1;
+    }
+
+    auto& names = sections[header.e_shstrndx];
+    std::string buffer(names.sh_size, 0);
+    stream.seekg(names.sh_offset);
+    if (!stream.read(&buffer[0], buffer.size())) {
+        return -1;
+    }
+
+    for (auto& section : sections) {
+        if (section.sh_name < buffer.size() && strcmp(buffer.c_str() + section.sh_name, ".text") == 0) {
+            return section.sh_size;
+        }
+    }
+    return -1;
+}
+
+// Returns the CPU time, in seconds, that GCC's -ftime-report attributes to
+// template instantiation. GCC does not report an instantiation count.
+double instantiation_time(const std::string& report_path) {
+    std::ifstream stream(report_path);
+    std::string line;
+    while (std::getline(stream, line)) {
+        auto colon = line.find(':');
+        if (colon == line.npos || line.find("template instantiation") == line.npos) {
+            continue;
+        }
+        double usr = 0, sys = 0;
+        sscanf(line.c_str() + colon + 1, "%lf ( %*d%%) %lf", &usr, &sys);
+        return usr + sys;
+    }
+    return 0;
+}
+
+// Per-snippet limits on compile cost. Each line of the budget file is
+// "<snippet> <metric> <warning limit> [<error limit>]", where <snippet> is a
+// snippet path relative to the sources folder or * for the default. Lines
+// starting with # are ignored. Saving keeps the order of the original lines
+// and rewrites only the limits changed by rebaseline.
+class Budgets {
+    std::map<std::string, std::pair<double, double>> m_limits;
+    std::map<std::pair<std::string, int>, double> m_measured;
+    std::vector<std::string> m_lines;
+    std::vector<std::string> m_line_keys;   // empty for comments
+    std::set<std::string> m_changed;
+    std::mutex m_mutex;
+
+    static std::string format_limit(const BudgetMetric& metric, double limit) {
+        if (metric.integral) {
+            return std::to_string((long long)ceil(limit));
+        }
+        std::ostringstream stream;
+        stream << limit;
+        return stream.str();
+    }
+
+    static bool parse_limit(const std::string& field, double& limit) {
+        char* end;
+        limit = strtod(field.c_str(), &end);
+        return !field.empty() && *end == 0 && limit >= 0;
+    }
+
+    static bool is_metric(const std::string& name) {
+        for (auto& metric : BudgetMetrics) {
+            if (name == metric.name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    // Returns the number of invalid lines, which are reported and ignored.
+    int load(const std::string& path) {
+        std::ifstream stream(path);
+        if (!stream.is_open()) {
+            std::cout << "Couldn't open budget file: " << path << '\n';
+            return 0;
+        }
+        int invalid = 0;
+        std::string line;
+        while (std::getline(stream, line)) {
+            m_lines.push_back(line);
+            m_line_keys.emplace_back();
+            std::istringstream fields(line);
+            std::string snippet, metric, warning_field, error_field, rest;
+            if (!(fields >> snippet) || snippet[0] == '#') {
+                continue;
+            }
+            fields >> metric >> warning_field >> error_field >> rest;
+            if (error_field[0] == '#') {
+                error_field.clear();
+                rest.clear();
+            }
+            double warning, error = -1;
+            if (!is_metric(metric) || !parse_limit(warning_field, warning)
+                || (!error_field.empty() && !parse_limit(error_field, error))
+                || (!rest.empty() && rest[0] != '#'))
+            {
+                std::cout << "Error: invalid line " << m_lines.size() << " in budget file " << path << ": " << line << '\n';
+                invalid++;
+                continue;
+            }
+            m_limits[snippet + ' ' + metric] = {warning, error};
+            m_line_keys.back() = snippet + ' ' + metric;
+        }
+        return invalid;
+    }
+
+    void save(const std::string& path) {
+        std::ofstream stream(path);
+        if (!stream.is_open()) {
+            std::cout << "Couldn't write budget file: " << path << '\n';
+            return;
+        }
+        auto write_limit = [&](const std::string& key) {
+            auto metric_name = key.substr(key.rfind(' ') + 1);
+            auto& [warning, error] = m_limits[key];
+            for (auto& metric : BudgetMetrics) {
+                if (metric_name == metric.name) {
+                    stream << key << ' ' << format_limit(metric, warning);
+                    if (error >= 0) {
+                        stream << ' ' << format_limit(metric, error);
+                    }
+                    stream << '\n';
+                }
+            }
+        };
+
+        std::set<std::string> written;
+        for (size_t i = 0; i < m_lines.size(); i++) {
+            auto& key = m_line_keys[i];
+            if (!key.empty() && m_changed.count(key)) {
+                if (written.insert(key).second) {
+                    write_limit(key);
+                }
+            } else {
+                stream << m_lines[i] << '\n';
+            }
+        }
+        for (auto& key : m_changed) {
+            if (!written.count(key)) {
+                write_limit(key);
+            }
+        }
+    }
+
+    // Returns 0 if the value is within budget, 1 if it exceeds the warning
+    // limit and 2 if it exceeds the error limit. Stores the exceeded limit.
+    // Limits missing for the snippet are taken from the * entry.
+    int check(const std::string& snippet, const std::string& metric, double value, double& limit) {
+        double warning = -1, error = -1;
+        for (auto& key : {snippet + ' ' + metric, "* " + metric}) {
+            auto it = m_limits.find(key);
+            if (it != m_limits.end()) {
+                if (warning < 0) {
+                    warning = it->second.first;
+                }
+                if (error < 0) {
+                    error = it->second.second;
+                }
+            }
+        }
+        if (error >= 0 && value > error) {
+            limit = error;
+            return 2;
+        }
+        if (warning >= 0 && value > warning) {
+            limit = warning;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Remembers the largest value of a metric over all standards of a snippet.
+    void record(const std::string& snippet, int metric, double value) {
+        std::unique_lock lock(m_mutex);
+        auto it = m_measured.try_emplace({snippet, metric}, value).first;
+        it->second = std::max(it->second, value);
+    }
+
+    // Replaces the per-snippet limits of all measured snippets with the
+    // recorded values plus the metric's headroom. Failed measurements are
+    // negative and leave the limit unchanged.
+    void rebaseline() {
+        for (auto& [snippet_metric, value] : m_measured) {
+            auto& [snippet, index] = snippet_metric;
+            auto& metric = BudgetMetrics[index];
+            if (value < 0) {
+                continue;
+            }
+            auto key = snippet + ' ' + metric.name;
+            m_limits[key] = {
+                value + std::max(value * metric.warning_headroom, metric.min_headroom),
+                value + std::max(value * metric.error_headroom, 2 * metric.min_headroom),
+            };
+            m_changed.insert(key);
+        }
+    }
+};
+
+struct Job {
+    double expected;    // expected duration in seconds
+    double priority;    // jobs with higher priority are started first
+    bool positive;      // compile+run job, as opposed to a negative probe
+    std::function<void()> task;
+};
+
+// Simulates a greedy schedule of the jobs, in order, on the given number of
+// threads and returns the expected makespan in seconds.
+double predict_makespan(const std::vector<Job>& jobs, size_t threads) {
+    std::priority_queue<double, std::vector<double>, std::greater<double>> free_at;
+    for (size_t i = 0; i < threads; i++) {
+        free_at.push(0);
+    }
+    double makespan = 0;
+    for (auto& job : jobs) {
+        double finish = free_at.top() + job.expected;
+        free_at.pop();
+        free_at.push(finish);
+        makespan = std::max(makespan, finish);
+    }
+    return makespan;
+}
+
 int main(int argc, char* argv[]) {
 
     std::string compiler_path = DefaultCompilerPath;
     std::string threads = std::to_string(DefaultThreads);
     std::string sources_folder;
+    std::string history_file = DefaultHistoryFile;
+    std::string budget_file;
+    bool check_budgets = false;
+    bool update_budgets = false;
     std::pair<std::string*, std::string> supported_options[] = {
         {&compiler_path, "--compiler-path="},
         {&threads, "--threads="},
         {&sources_folder, "--sources-folder="},
+        {&history_file, "--history-file="},
+        {&budget_file, "--budget-file="},
+    };
+    std::pair<bool*, std::string> supported_flags[] = {
+        {&check_budgets, "--budgets"},
+        {&update_budgets, "--update-budgets"},
     };
 
     // Parse command line options
@@ -116,6 +516,21 @@ int main(int argc, char* argv[]) {
                 *option.first = arg.substr(option.second.size());
             }
         }
+        for (auto& flag : supported_flags) {
+            if (arg == flag.second) {
+                *flag.first = true;
+            }
+        }
+    }
+    check_budgets |= update_budgets;
+    if (budget_file.empty()) {
+        budget_file = (std::filesystem::path(sources_folder) / DefaultBudgetFile).string();
+    }
+
+    int thread_count = stoi(threads);
+    if (thread_count < 1) {
+        std::cout << "Invalid thread count: " << threads << '\n';
+        return 1;
     }
 
     std::vector<std::string> input_files;
@@ -125,20 +540,65 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    ThreadPool executor(stoi(threads));
+    History history;
+    history.load(history_file);
+    // Jobs without history are assumed to be as expensive as the slowest known step.
+    double unknown_cost = std::max(history.max(compiler_path), 1.0);
+    int unknown_jobs = 0;
+
+    auto expected = [&](const std::string& key) {
+        double seconds = history.get(key);
+        if (seconds < 0) {
+            unknown_jobs++;
+            return unknown_cost;
+        }
+        return seconds;
+    };
+
     std::atomic<int> warnings = 0, errors = 0;
+    Budgets budgets;
+    if (check_budgets) {
+        errors += budgets.load(budget_file);
+    }
 
-    system("rm -rf tmp");
-    system("mkdir tmp");
+    // Compares compile cost metrics of a successful compilation against the budget.
+    auto check_compile = [&](const std::string& path, const std::string& snippet, int version, double cpu_seconds, long peak_rss_kb) {
+        double values[] = {
+            cpu_seconds,
+            (double)peak_rss_kb,
+            (double)text_size(exe_name(path, version)),
+            instantiation_time(report_name(path, version)),
+        };
+        for (int i = 0; i < 4; i++) {
+            budgets.record(snippet, i, values[i]);
+            double limit;
+            int verdict = update_budgets ? 0 : budgets.check(snippet, BudgetMetrics[i].name, values[i], limit);
+            if (verdict != 0) {
+                std::unique_lock lock(cout_mutex);
+                std::cout << (verdict == 2 ? "Error: " : "Warning: ") << path << " exceeds " << BudgetMetrics[i].name
+                    << " budget with cpp version " << two_digits(version) << ": " << values[i] << " > " << limit << '\n';
+                (verdict == 2 ? errors : warnings)++;
+            }
+        }
+    };
+
+    std::vector<Job> jobs;
 
     for (auto& path : input_files) {
         auto filename = split(path, '/').back();
         int file_cpp_ver = stoi(split(filename, '.')[1]);
+        auto snippet = std::filesystem::path(path).lexically_relative(sources_folder).string();
+        size_t first_job = jobs.size();
+        double min_positive = unknown_cost;
         for (int version : {3, 11, 14, 17, 20, 23}) {
+            auto compile_key = History::key(compiler_path, snippet, version, "compile");
             if (version < file_cpp_ver) {
-                executor.push([version, compiler_path, path, &warnings]() {
+                double cost = expected(compile_key);
+                jobs.push_back({cost, cost, false, [version, compiler_path, path, compile_key, &history, &warnings]() {
                     auto cmd = make_cmd(compiler_path, version, path, true);
-                    int status = system(cmd.c_str());
+                    double seconds;
+                    int status = timed_system(cmd, seconds);
+                    history.set(compile_key, seconds);
                     if (status == 0) {
                         std::unique_lock lock(cout_mutex);
                         std::cout << "Warning: " << path << " compiles with lower cpp version " << two_digits(version) << '\n';
@@ -147,18 +607,31 @@ int main(int argc, char* argv[]) {
                         std::unique_lock lock(cout_mutex);
                         std::cout << "OK: " << path << ' ' << two_digits(version) << '\n';
                     }
-                });
+                }});
             } else {
-                executor.push([version, compiler_path, path, &errors]() {
-                    auto cmd = make_cmd(compiler_path, version, path, false);
-                    int status = system(cmd.c_str());
+                auto run_key = History::key(compiler_path, snippet, version, "run");
+                double cost = expected(compile_key) + expected(run_key);
+                min_positive = std::min(min_positive, cost);
+                jobs.push_back({cost, cost, true, [version, compiler_path, path, snippet, compile_key, run_key, check_budgets, &check_compile, &history, &errors]() {
+                    auto cmd = make_cmd(compiler_path, version, path, false, check_budgets);
+                    double seconds, cpu_seconds;
+                    long peak_rss_kb;
+                    int status = timed_system(cmd, seconds, &cpu_seconds, &peak_rss_kb);
+                    // -ftime-report slows compilation down, keep it out of the history.
+                    if (!check_budgets) {
+                        history.set(compile_key, seconds);
+                    }
                     if (status != 0) {
                         std::unique_lock lock(cout_mutex);
                         std::cout << "Error: " << path << " does not compile with cpp version " << two_digits(version) << '\n';
                         errors++;
                     } else {
+                        if (check_budgets) {
+                            check_compile(path, snippet, version, cpu_seconds, peak_rss_kb);
+                        }
                         auto cmd = "./" + exe_name(path, version) + " >/dev/null";
-                        int status = system(cmd.c_str());
+                        int status = timed_system(cmd, seconds);
+                        history.set(run_key, seconds);
                         if (status != 0) {
                             std::unique_lock lock(cout_mutex);
                             std::cout << "Error: " << path << " failed test with cpp version " << two_digits(version) << '\n';
@@ -168,13 +641,49 @@ int main(int argc, char* argv[]) {
                             std::cout << "OK: " << path << ' ' << two_digits(version) << '\n';
                         }
                     }
-                });
+                }});
             }
         }
+        // A snippet's negative probes never start before its positive jobs.
+        for (size_t i = first_job; i < jobs.size(); i++) {
+            if (!jobs[i].positive) {
+                jobs[i].priority = std::min(jobs[i].priority, min_positive);
+            }
+        }
+    }
+
+    // Longest expected job first, positive jobs first on ties.
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        return a.positive > b.positive;
+    });
+
+    double predicted = predict_makespan(jobs, thread_count);
+
+    system("rm -rf tmp");
+    system("mkdir tmp");
+
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool executor(thread_count);
+    for (auto& job : jobs) {
+        executor.push(std::move(job.task));
     }
 
     executor.wait();
+    double actual = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     system("rm -rf tmp");
+    history.save(history_file, compiler_path);
+    if (update_budgets) {
+        budgets.rebaseline();
+        budgets.save(budget_file);
+    }
+    std::cout << "Predicted time " << predicted << "s";
+    if (unknown_jobs > 0) {
+        std::cout << " (" << unknown_jobs << " steps without history)";
+    }
+    std::cout << ", actual time " << actual << "s.\n";
     std::cout << "Finished with " << warnings << " warnings and " << errors << " errors.\n";
     return (warnings + errors) > 0;
 }